@@ -14,18 +14,118 @@
 
 #include <algorithm>
 #include <chrono>
+#include <climits>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <memory>
+#include <mutex>
 #include <thread>
+#include <vector>
 
 #include <libusb.h>
 
 #include <android-base/logging.h>
+#include <android-base/parseint.h>
 
 namespace {
 
-constexpr int kBulkChunk = 16384;
+// Write() splits its buffer into transfers of kTransferSize bytes and submits up
+// to kQueueDepth of them before reaping the oldest, so on the asynchronous
+// backends (windows) the bus stays busy for the whole of one Write() call. The
+// ring is drained before Write() returns, so the bus still idles between calls.
+// On BSD libusb_submit_transfer() runs each transfer to completion and nothing is
+// ever in flight. The geometry can be tuned at runtime with
+// FASTBOOT_LIBUSB_QUEUE_DEPTH / FASTBOOT_LIBUSB_TRANSFER_SIZE.
+constexpr size_t kQueueDepth = 8;
+constexpr size_t kTransferSize = 1024 * 1024;
+constexpr size_t kMaxQueueDepth = 64;
+constexpr size_t kMaxTransferSize = 16 * 1024 * 1024;
+
+// Transfer sizes are whole multiples of this, which is a multiple of every bulk
+// max-packet size: a bulk-IN never ends mid-packet (overflow) and a bulk-OUT never
+// puts a short packet in the middle of a download.
+constexpr size_t kTransferAlign = 16384;
+
+// Consecutive libusb event-loop failures Reap() tolerates before giving up.
+constexpr int kMaxEventErrors = 16;
+
+// Bulk-IN read-ahead: this many small transfers stay posted between Read() calls,
+// so OKAY/INFO/TEXT responses land while the host is still busy elsewhere. The
+// size is a multiple of every bulk max-packet size, so a response never overflows.
+// What lands in these slots is copied out: UsbTransport::Read(void*, size_t) fills
+// a buffer the caller owns, so a completed slot cannot be handed over instead, and
+// up to kReadAheadDepth * kReadAheadSize bytes at the start of a payload go
+// through that copy.
+// Only windows gets read-ahead: the BSD libusb backends (see freebsd_usb.c) run
+// transfers synchronously inside libusb_submit_transfer(), so a posted read with
+// no timeout would block until the device spoke, and it only speaks after the
+// next command.
+#if defined(_WIN32)
+constexpr size_t kReadAheadDepth = 4;
+#else
+constexpr size_t kReadAheadDepth = 0;
+#endif
+constexpr size_t kReadAheadSize = kTransferAlign;
+
+// How long usb_open() leaves a device that could not be opened before retrying:
+// briefly for errors that usually clear by themselves, longer for devices not
+// bound to WinUSB (yet -- the driver may still be installing, or be bound later
+// with Zadig while fastboot waits).
+constexpr auto kProbeRetry = std::chrono::seconds(1);
+constexpr auto kProbeRetryUnbound = std::chrono::seconds(5);
+
+size_t env_size(const char* name, size_t def, size_t max) {
+    const char* v = getenv(name);
+    size_t value = 0;
+    if (v == nullptr || !android::base::ParseUint(v, &value, max) || value == 0) return def;
+    return value;
+}
+
+size_t queue_depth() {
+    static const size_t depth =
+            env_size("FASTBOOT_LIBUSB_QUEUE_DEPTH", kQueueDepth, kMaxQueueDepth);
+    return depth;
+}
+
+size_t transfer_size() {
+    static const size_t size = std::max(
+            env_size("FASTBOOT_LIBUSB_TRANSFER_SIZE", kTransferSize, kMaxTransferSize) /
+                    kTransferAlign * kTransferAlign,
+            kTransferAlign);
+    return size;
+}
+
+// One asynchronous libusb_transfer. |done| is the flag libusb_handle_events_completed()
+// waits on, the same pattern libusb's own synchronous wrappers use, so reaping stays
+// correct if another thread happens to be running the event loop.
+struct AsyncTransfer {
+    libusb_transfer* xfer = nullptr;
+    int done = 1;
+};
+
+const char* transfer_status_name(const libusb_transfer* xfer) {
+    switch (xfer->status) {
+        case LIBUSB_TRANSFER_COMPLETED:
+            return "short transfer";
+        case LIBUSB_TRANSFER_TIMED_OUT:
+            return "timed out";
+        case LIBUSB_TRANSFER_CANCELLED:
+            return "cancelled";
+        case LIBUSB_TRANSFER_STALL:
+            return "endpoint stalled";
+        case LIBUSB_TRANSFER_NO_DEVICE:
+            return "device disconnected";
+        case LIBUSB_TRANSFER_OVERFLOW:
+            return "overflow";
+        default:
+            return "transfer error";
+    }
+}
+
+void LIBUSB_CALL on_transfer_done(libusb_transfer* xfer) {
+    static_cast<AsyncTransfer*>(xfer->user_data)->done = 1;
+}
 
 class LibusbTransport : public UsbTransport {
   public:
@@ -46,60 +146,302 @@ class LibusbTransport : public UsbTransport {
     int Reset() override;
 
   private:
+    // A posted read-ahead transfer, or one that completed and still holds data
+    // the caller has not consumed yet.
+    struct ReadAhead {
+        AsyncTransfer t;
+        std::vector<unsigned char> buf;
+        size_t offset = 0;
+    };
+
+    bool Submit(AsyncTransfer* t, uint8_t ep, unsigned char* buf, size_t len, uint32_t timeout_ms);
+    bool Reap(AsyncTransfer* t);
+    bool Wait(AsyncTransfer* t, uint32_t timeout_ms);
+    void FreeTransfer(AsyncTransfer* t);
+    void FreeTransfers(std::vector<AsyncTransfer>* ring);
+
+    ssize_t ReadDirect(unsigned char* buf, size_t len, bool* ended);
+    void ArmReadAhead();
+    bool CancelReadAhead();
+
     libusb_context* ctx_ = nullptr;
     libusb_device_handle* handle_ = nullptr;
     int interface_ = -1;
     uint8_t ep_in_ = 0;
     uint8_t ep_out_ = 0;
     uint32_t timeout_ms_ = 0;
+
+    // Bulk-OUT ring. Transfers point straight into the caller's buffer, so no
+    // payload is copied; Write() drains the ring before it returns.
+    std::vector<AsyncTransfer> out_;
+
+    // Bulk-IN. What the read-ahead ring already holds is copied out first, in order
+    // starting at |ahead_head_|; the rest of a read goes straight into the
+    // caller's buffer through |in_|.
+    AsyncTransfer in_;
+    std::vector<ReadAhead> ahead_;
+    size_t ahead_head_ = 0;
+    size_t ahead_count_ = 0;
 };
 
+bool LibusbTransport::Submit(AsyncTransfer* t, uint8_t ep, unsigned char* buf, size_t len,
+                             uint32_t timeout_ms) {
+    if (t->xfer == nullptr) {
+        t->xfer = libusb_alloc_transfer(0);
+        if (t->xfer == nullptr) return false;
+    }
+    libusb_fill_bulk_transfer(t->xfer, handle_, ep, buf, static_cast<int>(len), on_transfer_done,
+                              t, timeout_ms);
+    t->done = 0;
+    int rc = libusb_submit_transfer(t->xfer);
+    if (rc != 0) {
+        t->done = 1;
+        LOG(ERROR) << "fastboot libusb submit failed: " << libusb_error_name(rc);
+        return false;
+    }
+    return true;
+}
+
+// Runs libusb's event loop until |t| has completed (or been cancelled). If the event
+// loop keeps failing, the transfer is cancelled once and, after kMaxEventErrors,
+// abandoned: false is returned and |t| gets a fresh libusb_transfer on next use.
+bool LibusbTransport::Reap(AsyncTransfer* t) {
+    bool cancelled = false;
+    int errors = 0;
+    while (!t->done) {
+        int rc = libusb_handle_events_completed(ctx_, &t->done);
+        if (rc == 0 || rc == LIBUSB_ERROR_INTERRUPTED) continue;
+        if (!cancelled) {
+            libusb_cancel_transfer(t->xfer);
+            cancelled = true;
+        }
+        if (++errors >= kMaxEventErrors) {
+            LOG(ERROR) << "fastboot libusb event loop failed: " << libusb_error_name(rc);
+            // Leaked on purpose: libusb may still own it, and with the event loop
+            // down its callback cannot run.
+            t->xfer = nullptr;
+            t->done = 1;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Like Reap(), but gives up after |timeout_ms| (0 waits forever). Returns whether
+// |t| completed; on false it is still in flight, or was abandoned by Reap().
+bool LibusbTransport::Wait(AsyncTransfer* t, uint32_t timeout_ms) {
+    if (timeout_ms == 0) return Reap(t);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (!t->done) {
+        auto left = std::chrono::duration_cast<std::chrono::microseconds>(
+                deadline - std::chrono::steady_clock::now());
+        if (left.count() <= 0) return false;
+        timeval tv;
+        tv.tv_sec = static_cast<decltype(tv.tv_sec)>(left.count() / 1000000);
+        tv.tv_usec = static_cast<decltype(tv.tv_usec)>(left.count() % 1000000);
+        libusb_handle_events_timeout_completed(ctx_, &tv, &t->done);
+    }
+    return true;
+}
+
+void LibusbTransport::FreeTransfer(AsyncTransfer* t) {
+    if (!t->done) {
+        libusb_cancel_transfer(t->xfer);
+        Reap(t);
+    }
+    libusb_free_transfer(t->xfer);
+    t->xfer = nullptr;
+}
+
+void LibusbTransport::FreeTransfers(std::vector<AsyncTransfer>* ring) {
+    for (AsyncTransfer& t : *ring) FreeTransfer(&t);
+    ring->clear();
+}
+
 ssize_t LibusbTransport::Write(const void* data, size_t len) {
     if (handle_ == nullptr) return -1;
     auto* buf = const_cast<unsigned char*>(static_cast<const unsigned char*>(data));
+    if (out_.empty()) out_.resize(queue_depth());
+
+    const size_t depth = out_.size();
+    const size_t chunk = transfer_size();
+    size_t submitted = 0;  // bytes handed to libusb
+    size_t count = 0;      // bytes the device has acknowledged
+    size_t head = 0;       // oldest in-flight slot
+    size_t in_flight = 0;
+    bool failed = false;
+
+    while (in_flight > 0 || (!failed && submitted < len)) {
+        while (!failed && in_flight < depth && submitted < len) {
+            size_t n = std::min(len - submitted, chunk);
+            if (!Submit(&out_[(head + in_flight) % depth], ep_out_, buf + submitted, n,
+                        timeout_ms_)) {
+                failed = true;
+                break;
+            }
+            submitted += n;
+            ++in_flight;
+        }
+        if (in_flight == 0) break;
+
+        // Bulk transfers on one endpoint complete in submission order, so it is
+        // enough to wait on the oldest one.
+        AsyncTransfer& t = out_[head];
+        const bool reaped = Reap(&t);
+        head = (head + 1) % depth;
+        --in_flight;
+
+        if (failed) continue;  // draining after an error
+        if (!reaped || t.xfer->status != LIBUSB_TRANSFER_COMPLETED ||
+            t.xfer->actual_length != t.xfer->length) {
+            if (reaped) {
+                LOG(ERROR) << "fastboot libusb bulk-out failed: "
+                           << transfer_status_name(t.xfer);
+            }
+            failed = true;
+            // Later transfers would land out of order; pull them back before
+            // returning the caller's buffer.
+            for (size_t i = 0; i < in_flight; ++i) {
+                libusb_cancel_transfer(out_[(head + i) % depth].xfer);
+            }
+            continue;
+        }
+        count += static_cast<size_t>(t.xfer->actual_length);
+    }
+    return failed ? -1 : static_cast<ssize_t>(count);
+}
+
+// Posts every free read-ahead slot. These wait with no timeout: the device may
+// stay silent for as long as the host keeps writing.
+void LibusbTransport::ArmReadAhead() {
+    if (kReadAheadDepth == 0) return;
+    if (ahead_.empty()) {
+        ahead_.resize(kReadAheadDepth);
+        for (ReadAhead& r : ahead_) r.buf.resize(kReadAheadSize);
+    }
+    while (ahead_count_ < ahead_.size()) {
+        ReadAhead& r = ahead_[(ahead_head_ + ahead_count_) % ahead_.size()];
+        r.offset = 0;
+        if (!Submit(&r.t, ep_in_, r.buf.data(), r.buf.size(), 0)) return;
+        ++ahead_count_;
+    }
+}
+
+// Pulls back the posted read-ahead transfers. Whatever they had already received
+// stays queued (in order) for the next consumer. If a slot had to be abandoned
+// (see Reap()) the ring's contents are no longer trustworthy and are dropped.
+bool LibusbTransport::CancelReadAhead() {
+    for (size_t i = 0; i < ahead_count_; ++i) {
+        ReadAhead& r = ahead_[(ahead_head_ + i) % ahead_.size()];
+        if (!r.t.done) libusb_cancel_transfer(r.t.xfer);
+    }
+    bool ok = true;
+    for (size_t i = 0; i < ahead_count_; ++i) {
+        ReadAhead& r = ahead_[(ahead_head_ + i) % ahead_.size()];
+        if (!Reap(&r.t) || r.t.xfer == nullptr) ok = false;
+    }
+    if (!ok) ahead_count_ = 0;
+    return ok;
+}
+
+// Reads straight into |buf| until |len| bytes arrived or a short packet ended the
+// device's transfer (reported through |ended|). Unlike Write() this is not split
+// into a ring of transfers: after a short packet, transfers queued behind it
+// would already be receiving the next response and would have to be cancelled,
+// and WinUSB's AbortPipe does not promise to report what a cancelled IN transfer
+// had received. So one transfer covers the whole request (libusb and the OS
+// driver queue its packets back to back), as the synchronous read did, and
+// nothing is ever cancelled; this also keeps the synchronous BSD backends from
+// blocking on a transfer the device has no data for.
+ssize_t LibusbTransport::ReadDirect(unsigned char* buf, size_t len, bool* ended) {
+    constexpr size_t kMaxRead = static_cast<size_t>(INT_MAX) / kTransferAlign * kTransferAlign;
     size_t count = 0;
     while (count < len) {
-        int chunk = static_cast<int>(std::min(len - count, static_cast<size_t>(kBulkChunk)));
-        int transferred = 0;
-        int rc = libusb_bulk_transfer(handle_, ep_out_, buf + count, chunk, &transferred,
-                                      timeout_ms_);
-        if (rc != 0) {
-            LOG(ERROR) << "fastboot libusb bulk-out failed: " << libusb_error_name(rc);
+        size_t n = std::min(len - count, kMaxRead);
+        if (!Submit(&in_, ep_in_, buf + count, n, timeout_ms_)) return -1;
+        if (!Reap(&in_)) return -1;
+        if (in_.xfer->status != LIBUSB_TRANSFER_COMPLETED) {
+            LOG(ERROR) << "fastboot libusb bulk-in failed: " << transfer_status_name(in_.xfer);
             return -1;
         }
-        count += static_cast<size_t>(transferred);
+        const size_t actual = static_cast<size_t>(in_.xfer->actual_length);
+        count += actual;
+        if (actual < n) {
+            *ended = true;
+            break;
+        }
     }
     return static_cast<ssize_t>(count);
 }
 
+// Mirrors a single bulk-IN of |len| bytes: returns once |len| bytes arrived or a
+// short packet ended the device's transfer. Data comes, in order, from the
+// read-ahead ring, then the wire directly.
 ssize_t LibusbTransport::Read(void* data, size_t len) {
     if (handle_ == nullptr) return -1;
     auto* buf = static_cast<unsigned char*>(data);
-    int transferred = 0;
-    int rc = libusb_bulk_transfer(handle_, ep_in_, buf, static_cast<int>(len), &transferred,
-                                  timeout_ms_);
-    if (rc != 0) {
-        LOG(ERROR) << "fastboot libusb bulk-in failed: " << libusb_error_name(rc);
-        return -1;
+    size_t count = 0;
+    bool ended = false;
+
+    while (count < len && !ended && ahead_count_ > 0) {
+        ReadAhead& r = ahead_[ahead_head_];
+        // Even for a bulk read the posted slots are drained rather than cancelled:
+        // the payload reaches them in order anyway, and not every backend reports
+        // what a cancelled IN transfer had already received (WinUSB's AbortPipe).
+        if (!r.t.done && !Wait(&r.t, timeout_ms_)) {
+            LOG(ERROR) << "fastboot libusb bulk-in failed: timed out";
+            CancelReadAhead();
+            return -1;
+        }
+        const size_t actual = static_cast<size_t>(r.t.xfer->actual_length);
+        if (r.t.xfer->status != LIBUSB_TRANSFER_COMPLETED &&
+            r.t.xfer->status != LIBUSB_TRANSFER_CANCELLED && actual == 0) {
+            LOG(ERROR) << "fastboot libusb bulk-in failed: " << transfer_status_name(r.t.xfer);
+            CancelReadAhead();
+            return -1;
+        }
+        size_t n = std::min(len - count, actual - r.offset);
+        memcpy(buf + count, r.buf.data() + r.offset, n);
+        count += n;
+        r.offset += n;
+        if (r.offset == actual) {
+            ended = r.t.xfer->status == LIBUSB_TRANSFER_COMPLETED && actual < r.buf.size();
+            ahead_head_ = (ahead_head_ + 1) % ahead_.size();
+            --ahead_count_;
+        }
+    }
+
+    if (count < len && !ended) {
+        ssize_t n = ReadDirect(buf + count, len - count, &ended);
+        if (n < 0) return -1;
+        count += static_cast<size_t>(n);
     }
-    return static_cast<ssize_t>(transferred);
+
+    ArmReadAhead();
+    return static_cast<ssize_t>(count);
 }
 
 int LibusbTransport::Close() {
     if (handle_ != nullptr) {
+        FreeTransfers(&out_);
+        FreeTransfer(&in_);
+        CancelReadAhead();
+        for (ReadAhead& r : ahead_) libusb_free_transfer(r.t.xfer);
+        ahead_.clear();
+        ahead_head_ = ahead_count_ = 0;
         if (interface_ >= 0) libusb_release_interface(handle_, interface_);
         libusb_close(handle_);
         handle_ = nullptr;
     }
-    if (ctx_ != nullptr) {
-        libusb_exit(ctx_);
-        ctx_ = nullptr;
-    }
+    ctx_ = nullptr;  // shared with DeviceCache, which outlives every transport
     return 0;
 }
 
 int LibusbTransport::Reset() {
     if (handle_ == nullptr) return -1;
+    // Nothing received before the reset is meaningful afterwards.
+    CancelReadAhead();
+    ahead_count_ = 0;
     return libusb_reset_device(handle_) == 0 ? 0 : -1;
 }
 
@@ -133,68 +475,182 @@ void fill_ifc_info(const libusb_device_descriptor& dd, const libusb_interface_de
     }
 }
 
-}  // namespace
+// usb_open() is polled in a loop while fastboot waits for a device. Rather than a
+// libusb_init() and a full bus walk (opening every device to read its serial) per
+// call, one context lives for the whole process next to a cache of every attached
+// device's interfaces and serial. Each call still re-lists the bus, but only
+// probes devices it has not seen before (or, on a backoff, ones it could not open
+// yet), and matching then opens only the devices the callback accepts. (libusb
+// hotplug would avoid the re-list, but neither target building this file has it:
+// the windows and BSD backends implement get_device_list and so never report
+// LIBUSB_CAP_HAS_HOTPLUG.)
+class DeviceCache {
+  public:
+    static DeviceCache& Get() {
+        static DeviceCache* cache = new DeviceCache;  // outlives every transport
+        return *cache;
+    }
 
-std::unique_ptr<UsbTransport> usb_open(ifc_match_func callback, uint32_t timeout_ms) {
-    libusb_context* ctx = nullptr;
-    if (libusb_init(&ctx) != 0) {
+    std::unique_ptr<UsbTransport> Open(ifc_match_func callback, uint32_t timeout_ms);
+
+  private:
+    struct Interface {
+        usb_ifc_info info;
+        int number;
+        uint8_t ep_in;
+        uint8_t ep_out;
+    };
+
+    struct Device {
+        libusb_device* dev = nullptr;  // referenced while cached
+        bool probed = false;
+        bool openable = false;
+        std::chrono::steady_clock::time_point next_probe;
+        std::vector<Interface> interfaces;
+    };
+
+    DeviceCache();
+
+    void Refresh();
+    void Add(libusb_device* dev);
+    void Remove(libusb_device* dev);
+    void Probe(Device* d);
+
+    libusb_context* ctx_ = nullptr;
+
+    std::mutex mutex_;
+    std::vector<Device> devices_;
+};
+
+DeviceCache::DeviceCache() {
+    if (libusb_init(&ctx_) != 0) {
         LOG(ERROR) << "fastboot: libusb_init failed";
-        return nullptr;
+        ctx_ = nullptr;
+    }
+}
+
+void DeviceCache::Add(libusb_device* dev) {
+    for (const Device& d : devices_) {
+        if (d.dev == dev) return;
+    }
+    Device d;
+    d.dev = libusb_ref_device(dev);
+    devices_.push_back(std::move(d));
+}
+
+void DeviceCache::Remove(libusb_device* dev) {
+    for (auto it = devices_.begin(); it != devices_.end(); ++it) {
+        if (it->dev == dev) {
+            libusb_unref_device(it->dev);
+            devices_.erase(it);
+            return;
+        }
     }
+}
 
+void DeviceCache::Refresh() {
+    // libusb hands back the same libusb_device for a device that stays attached
+    // while we hold a reference, so a pointer compare finds the new ones.
     libusb_device** devs = nullptr;
-    ssize_t n = libusb_get_device_list(ctx, &devs);
-    std::unique_ptr<UsbTransport> result;
-
-    for (ssize_t i = 0; i < n && !result; ++i) {
-        libusb_device* dev = devs[i];
-
-        libusb_device_descriptor dd;
-        if (libusb_get_device_descriptor(dev, &dd) != 0) continue;
-
-        libusb_config_descriptor* cfg = nullptr;
-        if (libusb_get_active_config_descriptor(dev, &cfg) != 0) continue;
-
-        const uint8_t bus = libusb_get_bus_number(dev);
-        const uint8_t addr = libusb_get_device_address(dev);
-
-        for (uint8_t ii = 0; ii < cfg->bNumInterfaces && !result; ++ii) {
-            const libusb_interface& intf = cfg->interface[ii];
-            for (int alt = 0; alt < intf.num_altsetting && !result; ++alt) {
-                const libusb_interface_descriptor& id = intf.altsetting[alt];
-
-                usb_ifc_info info;
-                uint8_t ep_in = 0, ep_out = 0;
-                fill_ifc_info(dd, id, bus, addr, &info, &ep_in, &ep_out);
-
-                // Opening the device lets us read the serial and is also how we
-                // filter to WinUSB-bound devices on windows.
-                libusb_device_handle* handle = nullptr;
-                if (libusb_open(dev, &handle) != 0) continue;
-
-                if (dd.iSerialNumber != 0) {
-                    libusb_get_string_descriptor_ascii(
-                        handle, dd.iSerialNumber,
-                        reinterpret_cast<unsigned char*>(info.serial_number),
-                        sizeof(info.serial_number));
-                }
-
-                if (callback(&info) == 0 && info.has_bulk_in && info.has_bulk_out) {
-                    libusb_set_auto_detach_kernel_driver(handle, 1);  // no-op on windows
-                    if (libusb_claim_interface(handle, id.bInterfaceNumber) == 0) {
-                        result = std::make_unique<LibusbTransport>(
-                            ctx, handle, id.bInterfaceNumber, ep_in, ep_out, timeout_ms);
-                        handle = nullptr;  // ownership moved into the transport
-                    }
-                }
-
-                if (handle != nullptr) libusb_close(handle);
+    ssize_t n = libusb_get_device_list(ctx_, &devs);
+    if (n < 0) return;
+    std::vector<libusb_device*> gone;
+    for (const Device& d : devices_) {
+        if (std::find(devs, devs + n, d.dev) == devs + n) gone.push_back(d.dev);
+    }
+    for (libusb_device* dev : gone) Remove(dev);
+    for (ssize_t i = 0; i < n; ++i) Add(devs[i]);
+    libusb_free_device_list(devs, 1);
+}
+
+// Reads the descriptors and serial once per attached device. Opening the device is
+// also how we filter to WinUSB-bound devices on windows: one without WinUSB fails
+// with LIBUSB_ERROR_NOT_SUPPORTED. No failure is final while the device stays
+// attached; transient ones (access, busy, I/O, descriptors) are retried after
+// kProbeRetry, anything else after kProbeRetryUnbound, rather than on every poll.
+void DeviceCache::Probe(Device* d) {
+    auto retry_later = [d](std::chrono::steady_clock::duration delay = kProbeRetry) {
+        d->next_probe = std::chrono::steady_clock::now() + delay;
+    };
+
+    libusb_device_descriptor dd;
+    if (libusb_get_device_descriptor(d->dev, &dd) != 0) {
+        retry_later();
+        return;
+    }
+
+    libusb_config_descriptor* cfg = nullptr;
+    if (libusb_get_active_config_descriptor(d->dev, &cfg) != 0) {
+        retry_later();
+        return;
+    }
+
+    libusb_device_handle* handle = nullptr;
+    int rc = libusb_open(d->dev, &handle);
+    if (rc != 0) {
+        libusb_free_config_descriptor(cfg);
+        if (rc == LIBUSB_ERROR_ACCESS || rc == LIBUSB_ERROR_BUSY || rc == LIBUSB_ERROR_IO) {
+            retry_later();
+        } else {
+            retry_later(kProbeRetryUnbound);
+        }
+        return;
+    }
+    d->probed = true;
+    d->openable = true;
+
+    char serial[sizeof(usb_ifc_info::serial_number)] = {};
+    if (dd.iSerialNumber != 0) {
+        libusb_get_string_descriptor_ascii(handle, dd.iSerialNumber,
+                                           reinterpret_cast<unsigned char*>(serial),
+                                           sizeof(serial));
+    }
+    libusb_close(handle);
+
+    const uint8_t bus = libusb_get_bus_number(d->dev);
+    const uint8_t addr = libusb_get_device_address(d->dev);
+    for (uint8_t ii = 0; ii < cfg->bNumInterfaces; ++ii) {
+        const libusb_interface& intf = cfg->interface[ii];
+        for (int alt = 0; alt < intf.num_altsetting; ++alt) {
+            const libusb_interface_descriptor& id = intf.altsetting[alt];
+            Interface ifc;
+            fill_ifc_info(dd, id, bus, addr, &ifc.info, &ifc.ep_in, &ifc.ep_out);
+            memcpy(ifc.info.serial_number, serial, sizeof(serial));
+            ifc.number = id.bInterfaceNumber;
+            d->interfaces.push_back(ifc);
+        }
+    }
+    libusb_free_config_descriptor(cfg);
+}
+
+std::unique_ptr<UsbTransport> DeviceCache::Open(ifc_match_func callback, uint32_t timeout_ms) {
+    if (ctx_ == nullptr) return nullptr;
+    std::lock_guard<std::mutex> lock(mutex_);
+    Refresh();
+
+    for (Device& d : devices_) {
+        if (!d.probed && std::chrono::steady_clock::now() >= d.next_probe) Probe(&d);
+        if (!d.openable) continue;
+
+        for (const Interface& ifc : d.interfaces) {
+            usb_ifc_info info = ifc.info;  // the callback may scribble on it
+            if (callback(&info) != 0 || !info.has_bulk_in || !info.has_bulk_out) continue;
+
+            libusb_device_handle* handle = nullptr;
+            if (libusb_open(d.dev, &handle) != 0) continue;
+            libusb_set_auto_detach_kernel_driver(handle, 1);  // no-op on windows
+            if (libusb_claim_interface(handle, ifc.number) == 0) {
+                return std::make_unique<LibusbTransport>(ctx_, handle, ifc.number, ifc.ep_in,
+                                                         ifc.ep_out, timeout_ms);
             }
+            libusb_close(handle);
         }
-        libusb_free_config_descriptor(cfg);
     }
+    return nullptr;
+}
 
-    libusb_free_device_list(devs, 1);
-    if (!result) libusb_exit(ctx);  // the transport owns ctx on success
-    return result;
+}  // namespace
+
+std::unique_ptr<UsbTransport> usb_open(ifc_match_func callback, uint32_t timeout_ms) {
+    return DeviceCache::Get().Open(callback, timeout_ms);
 }